@@ -16,19 +16,75 @@
     asm("isb"); \
 } while (0)
 
+// Disables interrupts, returning the previous PRIMASK so os_irq_restore leaves them disabled if
+// the caller was already in a critical section (unlike OS_EXIT_CRITICAL, which always enables them)
+static inline uint32_t os_irq_save(void)
+{
+	uint32_t primask;
+	asm volatile(
+		"mrs %0, primask\n"
+		"cpsid i\n"
+		: "=r"(primask) : : "memory"
+	);
+	return primask;
+}
+
+static inline void os_irq_restore(uint32_t primask)
+{
+	asm volatile("msr primask, %0" : : "r"(primask) : "memory");
+}
+
+// Kernel-private, only called by name from PendSV_Handler's assembly (not part of the public API)
+uint64_t os_task_switch_select(void);
+
+// Statements wrapped in this are compiled out entirely when statistics are disabled
+#if OS_STATS_ENABLED
+#define OS_STATS(...) __VA_ARGS__
+#else
+#define OS_STATS(...)
+#endif
+
+// Config sanity checks (task IDs and priorities are stored as uint8_t, UINT8_MAX is reserved)
+_Static_assert(MAX_NUM_TASKS >= 1 && MAX_NUM_TASKS < OS_INVALID_TASK_ID,
+		"MAX_NUM_TASKS must be 1-254");
+_Static_assert(MAX_PRIORITY_LEVEL <= 255, "MAX_PRIORITY_LEVEL must be 0-255");
+_Static_assert(OS_JOB_PRIORITY_LEVELS >= 1 && OS_JOB_PRIORITY_LEVELS <= 32,
+		"OS_JOB_PRIORITY_LEVELS must be 1-32");
+_Static_assert(offsetof(struct os_tcb, stack_pntr) == 0, "stack_pntr must be first in os_tcb");
+
 // Task-related variables
 static struct os_tcb tasks[MAX_NUM_TASKS];
-static int task_count = 0;
+static uint8_t task_count = 0;
 static struct os_tcb *running_task = NULL;
-static struct os_tcb *prev_task = NULL;
-static struct os_tcb *ready_list[MAX_PRIORITY_LEVEL];
+static struct os_tcb *ready_list[MAX_PRIORITY_LEVEL + 1];
 static uint8_t highest_priority = 0;
 
 // Related to the idle task
-#define IDLE_TASK_STACK_SZ 32
 static os_task_stack idle_os_task_stack[IDLE_TASK_STACK_SZ];
 static uint32_t ticks_in_idle = 0;
 
+// Jobs with an armed timer, so SysTick only has to visit those
+static struct os_job *timer_jobs = NULL;
+
+// Only needed to timestamp statistics. Volatile as it changes in SysTick_Handler while a task is
+// blocked, so the compiler must not reuse a value read before the task blocked.
+#if OS_STATS_ENABLED
+static volatile uint32_t tick_count = 0;
+#define TICK_COUNT_SZ sizeof(tick_count)
+#else
+#define TICK_COUNT_SZ 0
+#endif
+
+// Keep OS_KERNEL_RAM_SZ in daedalus_os.h honest
+_Static_assert(OS_KERNEL_RAM_SZ == sizeof(tasks) + sizeof(task_count) + sizeof(running_task)
+		+ sizeof(ready_list) + sizeof(highest_priority)
+		+ sizeof(idle_os_task_stack) + sizeof(ticks_in_idle) + sizeof(timer_jobs) + TICK_COUNT_SZ,
+		"OS_KERNEL_RAM_SZ is out of sync with the kernel's static variables");
+
+#ifdef OS_KERNEL_RAM_BUDGET
+_Static_assert(OS_KERNEL_RAM_SZ <= OS_KERNEL_RAM_BUDGET, "Kernel RAM exceeds OS_KERNEL_RAM_BUDGET");
+#endif
+
 
 
 
@@ -72,6 +128,10 @@ static struct os_tcb *os_get_next_ready_task(uint8_t priority)
 
 void os_init(void)
 {
+	/* Publish OS_KERNEL_RAM_SZ as an absolute symbol so the kernel's RAM shows up in the map file
+	   and nm output (e.g. "000005a4 A os_kernel_ram_sz") without costing any memory */
+	asm volatile(".global os_kernel_ram_sz\n.set os_kernel_ram_sz, %c0" : : "i"(OS_KERNEL_RAM_SZ));
+
 	os_task_create(os_idle_task_entry, NULL, idle_os_task_stack, IDLE_TASK_STACK_SZ, 0);
 }
 
@@ -153,30 +213,44 @@ static void os_task_set_state(struct os_tcb *task, enum OS_TASK_STATE state)
 		os_list_insert_task(task, &ready_list[task->priority]);
 }
 
-static enum OS_STATUS os_task_wait(uint16_t timeout_ticks, struct os_tcb **blocked_list)
+// Moves the running task onto the blocked list, the context switch happens once PendSV can fire
+static void os_task_block(uint16_t timeout_ticks, struct os_tcb **blocked_list)
 {
-	// Don't wait
-	if (timeout_ticks == 0)
-		return OS_TIMEOUT;
-	
 	running_task->waiting = true;
+	running_task->blocked_list = blocked_list;
 
 	os_list_remove_task(running_task, &ready_list[running_task->priority]);
 	os_list_insert_task(running_task, blocked_list);
 
 	os_task_sleep(timeout_ticks);
+}
 
-	// TODO: But if task timed out we never removed from block list... fix that
+// Called once a blocked task runs again to find out if it was woken or timed out
+static enum OS_STATUS os_task_wait_status(void)
+{
+	// If the task timed out, SysTick_Handler has already removed it from the blocked list
 	bool waiting = running_task->waiting;
 	running_task->waiting = false;
 
 	return waiting ? OS_TIMEOUT : OS_SUCCESS;
 }
 
+static enum OS_STATUS os_task_wait(uint16_t timeout_ticks, struct os_tcb **blocked_list)
+{
+	// Don't wait
+	if (timeout_ticks == 0)
+		return OS_TIMEOUT;
+	
+	os_task_block(timeout_ticks, blocked_list);
+	return os_task_wait_status();
+}
+
 static void os_task_wake(struct os_tcb *task, struct os_tcb **list)
 {
+	/* timeout is left holding the ticks that remained, so a waiter that has to wait again can
+	   carry on with what is left of its timeout. SysTick_Handler only counts down blocked tasks. */
 	task->waiting = false;
-	task->timeout = 0;
+	task->blocked_list = NULL;
 	os_list_remove_task(task, list);
 	os_task_set_state(task, TASK_READY);
 }
@@ -191,16 +265,51 @@ static void os_list_wake_high_pri(struct os_tcb **list)
 	}
 }
 
+// Appends the job to the back of its host's pending list for its priority
+static void os_job_queue_pending(struct os_job *job)
+{
+	struct os_job_host *host = job->host;
+
+	job->next_pending = NULL;
+	if (host->pending_tail[job->priority])
+		host->pending_tail[job->priority]->next_pending = job;
+	else
+		host->pending_head[job->priority] = job;
+
+	host->pending_tail[job->priority] = job;
+	host->pending_pris |= 1UL << job->priority;
+}
+
+// Marks the job as pending and wakes its host if it is waiting for work
+static void os_job_trigger(struct os_job *job)
+{
+	/* Triggers come from both tasks and ISRs, so the increment must not be interrupted by
+	   another trigger or by the host consuming an activation. Saturate rather than wrap so a
+	   burst of activations is never lost entirely. This runs under every queue insert,
+	   semaphore give and event set, which callers may make from inside their own critical
+	   section, so PRIMASK is restored rather than interrupts unconditionally enabled. */
+	uint32_t primask = os_irq_save();
+	if (job->pending == 0)
+		os_job_queue_pending(job);
+	if (job->pending != UINT8_MAX)
+		job->pending++;
+	os_irq_restore(primask);
+
+	os_list_wake_high_pri(&job->host->blocked_list);
+}
+
 uint8_t os_task_create(os_task_entry entry, void *arg, os_task_stack *stack_base, size_t stack_sz,
 			uint8_t priority)
 {
+	if (task_count >= MAX_NUM_TASKS)
+		return OS_INVALID_TASK_ID;
+
 	struct os_tcb task = {
-		.entry = entry,
-		.arg = arg,
 		.stack_pntr = stack_base + stack_sz,
 		.priority = priority,
 		.next_task = NULL,
 		.prev_task = NULL,
+		.blocked_list = NULL,
 		.timeout = 0,
 		.waiting = false,
 		.wait_flags = 0,
@@ -233,9 +342,9 @@ uint8_t os_task_create(os_task_entry entry, void *arg, os_task_stack *stack_base
 	if (((int)task.stack_pntr % 8) != 0)
 		task.stack_pntr--;
 	*(task.stack_pntr - 1) = 0x1000000; // Sets Thumb-mode bit
-	*(task.stack_pntr - 2) = (uint32_t)task.entry;
+	*(task.stack_pntr - 2) = (uint32_t)entry;
 	*(task.stack_pntr - 3) = 0xFFFFFFFD; // Sets Thread mode with PSP
-	*(task.stack_pntr - 8) = (uint32_t)task.arg;
+	*(task.stack_pntr - 8) = (uint32_t)arg;
 	task.stack_pntr -= 16; // Decrement stack pointer to simulate 16 registers being pushed
 	
 	tasks[task_count] = task;
@@ -282,11 +391,19 @@ void os_mutex_create(struct os_mutex *mutex)
 {
 	mutex->holding_task = NULL;
 	mutex->blocked_list = NULL;
+	OS_STATS(
+		mutex->acquire_tick = 0;
+		memset(&mutex->stats, 0, sizeof(mutex->stats));
+	)
 }
 
 enum OS_STATUS os_mutex_acquire(struct os_mutex *mutex, uint16_t timeout_ticks)
 {
+	OS_STATS(uint32_t wait_start = tick_count;)
+
 	if (mutex->holding_task) {
+		OS_STATS(mutex->stats.contended_count++;)
+
 		// Priority inheritance
 		// TODO: Mostly redundant as os_task_wait removes from ready list
 		// We just don't want it removing from the wrong ready list
@@ -306,6 +423,16 @@ enum OS_STATUS os_mutex_acquire(struct os_mutex *mutex, uint16_t timeout_ticks)
 	
 	mutex->holding_task = running_task;
 	mutex->holding_task_orig_pri = running_task->priority;
+
+	OS_STATS(
+		uint32_t now = tick_count;
+		uint32_t wait_ticks = now - wait_start;
+		mutex->stats.acquire_count++;
+		mutex->stats.total_wait_ticks += wait_ticks;
+		if (wait_ticks > mutex->stats.max_wait_ticks)
+			mutex->stats.max_wait_ticks = wait_ticks;
+		mutex->acquire_tick = now;
+	)
 	return OS_SUCCESS;
 }
 
@@ -313,6 +440,12 @@ void os_mutex_release(struct os_mutex *mutex)
 {
 	mutex->holding_task->priority = mutex->holding_task_orig_pri;
 
+	OS_STATS(
+		uint32_t hold_ticks = tick_count - mutex->acquire_tick;
+		if (hold_ticks > mutex->stats.max_hold_ticks)
+			mutex->stats.max_hold_ticks = hold_ticks;
+	)
+
 	// If another task is waiting, we wake it but don't clear the holding task
 	// This is so other tasks still think this mutex is blocked and can't snag it
 	if (mutex->blocked_list)
@@ -330,12 +463,21 @@ void os_semph_create(struct os_semph *semph, uint8_t count)
 {
 	semph->count = count;
 	semph->blocked_list = NULL;
+	semph->set = NULL;
+	semph->job = NULL;
+	OS_STATS(memset(&semph->stats, 0, sizeof(semph->stats));)
 }
 
 enum OS_STATUS os_semph_take(struct os_semph *semph, uint16_t timeout_ticks)
 {
-	if (semph->count <= 0 && os_task_wait(timeout_ticks, &semph->blocked_list) == OS_TIMEOUT)
-		return OS_TIMEOUT;
+	if (semph->count <= 0) {
+		OS_STATS(semph->stats.wait_count++;)
+
+		if (os_task_wait(timeout_ticks, &semph->blocked_list) == OS_TIMEOUT) {
+			OS_STATS(semph->stats.timeout_count++;)
+			return OS_TIMEOUT;
+		}
+	}
 	
 	semph->count--;
 	return OS_SUCCESS;
@@ -344,7 +486,15 @@ enum OS_STATUS os_semph_take(struct os_semph *semph, uint16_t timeout_ticks)
 void os_semph_give(struct os_semph *semph)
 {
 	semph->count++;
-	os_list_wake_high_pri(&semph->blocked_list);
+
+	// Tasks waiting directly on the semaphore take precedence over a task selecting on its set
+	if (semph->blocked_list)
+		os_list_wake_high_pri(&semph->blocked_list);
+	else if (semph->set)
+		os_list_wake_high_pri(&semph->set->blocked_list);
+
+	if (semph->job)
+		os_job_trigger(semph->job);
 }
 
 enum OS_STATUS os_semph_take_isr(struct os_semph *semph)
@@ -366,15 +516,49 @@ void os_semph_give_isr(struct os_semph *semph)
 /***************************************************************************************************
  * Queue Functions
  **************************************************************************************************/
-static void os_queue_ins_common(struct os_queue *queue, const void *item)
+static bool os_queue_is_empty(const struct os_queue *queue)
 {
-	memcpy(queue->storage + queue->head, item, queue->item_sz);
-	queue->head = (queue->head + queue->item_sz) % queue->size;
+	return !queue->full && queue->head == queue->tail;
+}
+
+#if OS_STATS_ENABLED
+static size_t os_queue_get_count(const struct os_queue *queue)
+{
+	if (queue->full)
+		return queue->size / queue->item_sz;
+
+	return ((queue->head + queue->size - queue->tail) % queue->size) / queue->item_sz;
+}
+#endif
+
+static void os_queue_ins_common(struct os_queue *queue, const void *item, bool front)
+{
+	if (front) {
+		// Step the tail back one slot so this item is the next to be retrieved
+		queue->tail = (queue->tail + queue->size - queue->item_sz) % queue->size;
+		memcpy(queue->storage + queue->tail, item, queue->item_sz);
+	} else {
+		memcpy(queue->storage + queue->head, item, queue->item_sz);
+		queue->head = (queue->head + queue->item_sz) % queue->size;
+	}
 
 	if (queue->head == queue->tail)
 		queue->full = true;
 
-	os_list_wake_high_pri(&queue->rec_blocked_list);
+	OS_STATS(
+		size_t count = os_queue_get_count(queue);
+		if (count > queue->stats.high_water)
+			queue->stats.high_water = count;
+	)
+
+	// Tasks waiting directly on the queue take precedence over a task selecting on its set
+	if (queue->rec_blocked_list)
+		os_list_wake_high_pri(&queue->rec_blocked_list);
+	else if (queue->set)
+		os_list_wake_high_pri(&queue->set->blocked_list);
+
+	if (queue->job)
+		os_job_trigger(queue->job);
 }
 
 static void os_queue_ret_common(struct os_queue *queue, void *item)
@@ -396,20 +580,48 @@ void os_queue_create(struct os_queue *queue, size_t length, uint8_t *storage, si
 	queue->full = false;
 	queue->rec_blocked_list = NULL;
 	queue->ins_blocked_list = NULL;
+	queue->set = NULL;
+	queue->job = NULL;
+	OS_STATS(memset(&queue->stats, 0, sizeof(queue->stats));)
 }
 
 enum OS_STATUS os_queue_insert(struct os_queue *queue, const void *item, uint16_t timeout_ticks)
 {
+	OS_STATS(
+		if (queue->full)
+			queue->stats.full_count++;
+	)
+
+	if (queue->full && os_task_wait(timeout_ticks, &queue->ins_blocked_list) == OS_TIMEOUT)
+		return OS_TIMEOUT;
+
+	os_queue_ins_common(queue, item, false);
+	return OS_SUCCESS;
+}
+
+enum OS_STATUS os_queue_insert_front(struct os_queue *queue, const void *item,
+					uint16_t timeout_ticks)
+{
+	OS_STATS(
+		if (queue->full)
+			queue->stats.full_count++;
+	)
+
 	if (queue->full && os_task_wait(timeout_ticks, &queue->ins_blocked_list) == OS_TIMEOUT)
 		return OS_TIMEOUT;
 
-	os_queue_ins_common(queue, item);
+	os_queue_ins_common(queue, item, true);
 	return OS_SUCCESS;
 }
 
 enum OS_STATUS os_queue_retrieve(struct os_queue *queue, void *item, uint16_t timeout_ticks)
 {
-	bool queue_empty = !queue->full && queue->head == queue->tail;
+	bool queue_empty = os_queue_is_empty(queue);
+	OS_STATS(
+		if (queue_empty)
+			queue->stats.empty_count++;
+	)
+
 	if (queue_empty && os_task_wait(timeout_ticks, &queue->rec_blocked_list) == OS_TIMEOUT)
 		return OS_TIMEOUT;
 	
@@ -422,14 +634,22 @@ enum OS_STATUS os_queue_insert_isr(struct os_queue *queue, const void *item)
 	if (queue->full)
 		return OS_FAILED;
 	
-	os_queue_ins_common(queue, item);
+	os_queue_ins_common(queue, item, false);
+	return OS_SUCCESS;
+}
+
+enum OS_STATUS os_queue_insert_front_isr(struct os_queue *queue, const void *item)
+{
+	if (queue->full)
+		return OS_FAILED;
+	
+	os_queue_ins_common(queue, item, true);
 	return OS_SUCCESS;
 }
 
 enum OS_STATUS os_queue_retrieve_isr(struct os_queue *queue, void *item)
 {
-	bool queue_empty = !queue->full && queue->head == queue->tail;
-	if (queue_empty)
+	if (os_queue_is_empty(queue))
 		return OS_FAILED;
 	
 	os_queue_ret_common(queue, item);
@@ -438,6 +658,91 @@ enum OS_STATUS os_queue_retrieve_isr(struct os_queue *queue, void *item)
 
 
 
+/***************************************************************************************************
+ * Priority Queue Functions
+ **************************************************************************************************/
+/* Each slot in storage holds a one byte priority followed by the item. Slots are kept sorted so
+   priority increases towards the end of the buffer and, within a priority, older items sit closer
+   to the end. The next item to retrieve is therefore always the last slot, making retrieval O(1)
+   while insertion shifts any lower priority items up by one slot. */
+#define PQUEUE_SLOT_SZ(pqueue) ((pqueue)->item_sz + 1)
+#define PQUEUE_SLOT(pqueue, i) ((pqueue)->storage + ((i) * PQUEUE_SLOT_SZ(pqueue)))
+
+static void os_pqueue_ins_common(struct os_pqueue *pqueue, const void *item, uint8_t priority)
+{
+	// Find the first slot that should remain above the new item
+	size_t i = 0;
+	while (i < pqueue->count && *PQUEUE_SLOT(pqueue, i) < priority)
+		i++;
+
+	memmove(PQUEUE_SLOT(pqueue, i + 1), PQUEUE_SLOT(pqueue, i),
+		(pqueue->count - i) * PQUEUE_SLOT_SZ(pqueue));
+
+	*PQUEUE_SLOT(pqueue, i) = priority;
+	memcpy(PQUEUE_SLOT(pqueue, i) + 1, item, pqueue->item_sz);
+	pqueue->count++;
+
+	os_list_wake_high_pri(&pqueue->rec_blocked_list);
+}
+
+static void os_pqueue_ret_common(struct os_pqueue *pqueue, void *item)
+{
+	pqueue->count--;
+	memcpy(item, PQUEUE_SLOT(pqueue, pqueue->count) + 1, pqueue->item_sz);
+
+	os_list_wake_high_pri(&pqueue->ins_blocked_list);
+}
+
+void os_pqueue_create(struct os_pqueue *pqueue, size_t length, uint8_t *storage, size_t item_sz)
+{
+	pqueue->length = length;
+	pqueue->count = 0;
+	pqueue->item_sz = item_sz;
+	pqueue->storage = storage;
+	pqueue->rec_blocked_list = NULL;
+	pqueue->ins_blocked_list = NULL;
+}
+
+enum OS_STATUS os_pqueue_insert(struct os_pqueue *pqueue, const void *item, uint8_t priority,
+				uint16_t timeout_ticks)
+{
+	bool pqueue_full = pqueue->count == pqueue->length;
+	if (pqueue_full && os_task_wait(timeout_ticks, &pqueue->ins_blocked_list) == OS_TIMEOUT)
+		return OS_TIMEOUT;
+
+	os_pqueue_ins_common(pqueue, item, priority);
+	return OS_SUCCESS;
+}
+
+enum OS_STATUS os_pqueue_retrieve(struct os_pqueue *pqueue, void *item, uint16_t timeout_ticks)
+{
+	if (pqueue->count == 0 && os_task_wait(timeout_ticks, &pqueue->rec_blocked_list) == OS_TIMEOUT)
+		return OS_TIMEOUT;
+
+	os_pqueue_ret_common(pqueue, item);
+	return OS_SUCCESS;
+}
+
+enum OS_STATUS os_pqueue_insert_isr(struct os_pqueue *pqueue, const void *item, uint8_t priority)
+{
+	if (pqueue->count == pqueue->length)
+		return OS_FAILED;
+
+	os_pqueue_ins_common(pqueue, item, priority);
+	return OS_SUCCESS;
+}
+
+enum OS_STATUS os_pqueue_retrieve_isr(struct os_pqueue *pqueue, void *item)
+{
+	if (pqueue->count == 0)
+		return OS_FAILED;
+
+	os_pqueue_ret_common(pqueue, item);
+	return OS_SUCCESS;
+}
+
+
+
 /***************************************************************************************************
  * Event Group Functions
  **************************************************************************************************/
@@ -445,6 +750,9 @@ void os_event_create(struct os_event *event)
 {
 	event->flags = 0;
 	event->blocked_list = NULL;
+	event->job = NULL;
+	event->job_flags = 0;
+	OS_STATS(memset(&event->stats, 0, sizeof(event->stats));)
 }
 
 void os_event_set(struct os_event *event, uint8_t flags)
@@ -467,6 +775,9 @@ void os_event_set(struct os_event *event, uint8_t flags)
 
 	if (task_woken)
 		SW_CONTEXT();
+
+	if (event->job && (event->flags & event->job_flags) == event->job_flags)
+		os_job_trigger(event->job);
 }
 
 // Waits for ALL flags in event to be set, always clears flags on exit
@@ -474,9 +785,12 @@ enum OS_STATUS os_event_wait(struct os_event *event, uint8_t flags, uint16_t tim
 {
 	if ((event->flags & flags) != flags) {
 		running_task->wait_flags = flags;
+		OS_STATS(event->stats.wait_count++;)
 
-		if (os_task_wait(timeout_ticks, &event->blocked_list) == OS_TIMEOUT)
+		if (os_task_wait(timeout_ticks, &event->blocked_list) == OS_TIMEOUT) {
+			OS_STATS(event->stats.timeout_count++;)
 			return OS_TIMEOUT;
+		}
 	}
 	
 	// Clear flags before returning
@@ -490,54 +804,428 @@ void os_event_set_isr(struct os_event *event, uint8_t flags)
 }
 
 
+
+/***************************************************************************************************
+ * Condition Variable Functions
+ **************************************************************************************************/
+void os_cond_create(struct os_cond *cond)
+{
+	cond->blocked_list = NULL;
+}
+
+enum OS_STATUS os_cond_wait(struct os_cond *cond, struct os_mutex *mutex, uint16_t timeout_ticks)
+{
+	// Don't wait (and keep holding the mutex)
+	if (timeout_ticks == 0)
+		return OS_TIMEOUT;
+
+	/* Interrupts are disabled so PendSV can't fire until the task is both on the blocked list
+	   and has released the mutex. Otherwise a task woken by the release could signal before we
+	   were on the blocked list and the wake-up would be lost. Blocking first also removes the
+	   task from the ready list of any priority it inherited before the release restores it. */
+	OS_ENTER_CRITICAL();
+	os_task_block(timeout_ticks, &cond->blocked_list);
+	os_mutex_release(mutex);
+	OS_EXIT_CRITICAL();
+
+	enum OS_STATUS status = os_task_wait_status();
+
+	// Always return holding the mutex, even on timeout
+	while (os_mutex_acquire(mutex, UINT16_MAX) != OS_SUCCESS)
+		;
+
+	return status;
+}
+
+void os_cond_signal(struct os_cond *cond)
+{
+	os_list_wake_high_pri(&cond->blocked_list);
+}
+
+void os_cond_broadcast(struct os_cond *cond)
+{
+	if (!cond->blocked_list)
+		return;
+
+	while (cond->blocked_list)
+		os_task_wake(cond->blocked_list, &cond->blocked_list);
+
+	SW_CONTEXT();
+}
+
+
+
+/***************************************************************************************************
+ * Queue Set Functions
+ **************************************************************************************************/
+static enum OS_STATUS os_queue_set_add(struct os_queue_set *set, enum OS_QUEUE_SET_TYPE type,
+					void *obj)
+{
+	if (set->count >= set->length)
+		return OS_FAILED;
+
+	set->members[set->count].type = type;
+	set->members[set->count].obj = obj;
+	set->count++;
+	return OS_SUCCESS;
+}
+
+static struct os_queue_set_member *os_queue_set_get_ready(struct os_queue_set *set)
+{
+	for (size_t i = 0; i < set->count; i++) {
+		struct os_queue_set_member *member = &set->members[i];
+
+		if (member->type == QUEUE_SET_QUEUE) {
+			if (!os_queue_is_empty(member->obj))
+				return member;
+		} else if (((struct os_semph *)member->obj)->count > 0) {
+			return member;
+		}
+	}
+
+	return NULL;
+}
+
+void os_queue_set_create(struct os_queue_set *set, struct os_queue_set_member *members,
+				size_t length)
+{
+	set->members = members;
+	set->length = length;
+	set->count = 0;
+	set->blocked_list = NULL;
+}
+
+enum OS_STATUS os_queue_set_add_queue(struct os_queue_set *set, struct os_queue *queue)
+{
+	if (queue->set || os_queue_set_add(set, QUEUE_SET_QUEUE, queue) != OS_SUCCESS)
+		return OS_FAILED;
+
+	queue->set = set;
+	return OS_SUCCESS;
+}
+
+enum OS_STATUS os_queue_set_add_semph(struct os_queue_set *set, struct os_semph *semph)
+{
+	if (semph->set || os_queue_set_add(set, QUEUE_SET_SEMPH, semph) != OS_SUCCESS)
+		return OS_FAILED;
+
+	semph->set = set;
+	return OS_SUCCESS;
+}
+
+enum OS_STATUS os_queue_set_select(struct os_queue_set *set, struct os_queue_set_member *member,
+					uint16_t timeout_ticks)
+{
+	struct os_queue_set_member *ready = os_queue_set_get_ready(set);
+
+	// Don't wait
+	if (!ready && timeout_ticks == 0)
+		return OS_TIMEOUT;
+
+	/* A timed-out select is unlinked from the set's blocked list by SysTick_Handler, so it is
+	   safe to wait again if the member that woke us was emptied by someone else first. */
+	while (!ready) {
+		// Critical so an ISR can't make a member ready between the check and blocking
+		OS_ENTER_CRITICAL();
+		ready = os_queue_set_get_ready(set);
+		if (!ready)
+			os_task_block(timeout_ticks, &set->blocked_list);
+		OS_EXIT_CRITICAL();
+
+		if (!ready) {
+			if (os_task_wait_status() == OS_TIMEOUT)
+				return OS_TIMEOUT;
+
+			// Any further wait only gets what is left of the original timeout
+			timeout_ticks = running_task->timeout;
+			ready = os_queue_set_get_ready(set);
+		}
+	}
+
+	*member = *ready;
+	return OS_SUCCESS;
+}
+
+
+/***************************************************************************************************
+ * Lightweight Job Functions
+ **************************************************************************************************/
+// Consumes one activation of the highest priority pending job, must be called in a critical section
+static struct os_job *os_job_take_high_pri(struct os_job_host *host)
+{
+	if (!host->pending_pris)
+		return NULL;
+
+	// Compiles to a single CLZ, so finding the job doesn't depend on how many there are
+	uint8_t priority = 31 - __builtin_clz(host->pending_pris);
+	struct os_job *job = host->pending_head[priority];
+
+	host->pending_head[priority] = job->next_pending;
+	if (!host->pending_head[priority]) {
+		host->pending_tail[priority] = NULL;
+		host->pending_pris &= ~(1UL << priority);
+	}
+
+	// Jobs with activations left go to the back so jobs of the same priority take turns
+	if (--job->pending)
+		os_job_queue_pending(job);
+
+	return job;
+}
+
+static void os_job_timer_insert(struct os_job *job)
+{
+	job->prev_timer = NULL;
+	job->next_timer = timer_jobs;
+	if (timer_jobs)
+		timer_jobs->prev_timer = job;
+
+	timer_jobs = job;
+}
+
+static void os_job_timer_remove(struct os_job *job)
+{
+	if (job->next_timer)
+		job->next_timer->prev_timer = job->prev_timer;
+
+	if (job->prev_timer)
+		job->prev_timer->next_timer = job->next_timer;
+	else
+		timer_jobs = job->next_timer;
+
+	job->next_timer = NULL;
+	job->prev_timer = NULL;
+}
+
+/* Jobs are plain function calls on the host's stack, so dispatching one costs no context switch.
+   The host only blocks (with no timeout) when none of its jobs are pending. */
+static void os_job_host_entry(void *data)
+{
+	struct os_job_host *host = data;
+	while (1) {
+		/* Critical so a trigger from an ISR can't slip in between the check and blocking, or
+		   between reading and consuming the job's activation */
+		OS_ENTER_CRITICAL();
+		struct os_job *job = os_job_take_high_pri(host);
+		if (!job)
+			os_task_block(0, &host->blocked_list);
+		OS_EXIT_CRITICAL();
+
+		if (!job) {
+			os_task_wait_status();
+			continue;
+		}
+
+		job->entry(job, job->arg);
+	}
+}
+
+uint8_t os_job_host_create(struct os_job_host *host, os_task_stack *stack_base, size_t stack_sz,
+				uint8_t priority)
+{
+	memset(host->pending_head, 0, sizeof(host->pending_head));
+	memset(host->pending_tail, 0, sizeof(host->pending_tail));
+	host->pending_pris = 0;
+	host->blocked_list = NULL;
+
+	return os_task_create(os_job_host_entry, host, stack_base, stack_sz, priority);
+}
+
+void os_job_create(struct os_job *job, struct os_job_host *host, os_job_entry entry, void *arg,
+			uint8_t priority)
+{
+	job->entry = entry;
+	job->arg = arg;
+	job->host = host;
+	job->next_pending = NULL;
+	job->next_timer = NULL;
+	job->prev_timer = NULL;
+	job->timeout = 0;
+	job->period = 0;
+	job->lc = 0;
+	job->priority = (priority < OS_JOB_PRIORITY_LEVELS) ? priority : OS_JOB_PRIORITY_LEVELS - 1;
+	job->pending = 0;
+}
+
+void os_job_activate(struct os_job *job)
+{
+	os_job_trigger(job);
+}
+
+void os_job_activate_isr(struct os_job *job)
+{
+	os_job_trigger(job);
+}
+
+enum OS_STATUS os_job_bind_queue(struct os_job *job, struct os_queue *queue)
+{
+	if (queue->job)
+		return OS_FAILED;
+
+	queue->job = job;
+	return OS_SUCCESS;
+}
+
+enum OS_STATUS os_job_bind_semph(struct os_job *job, struct os_semph *semph)
+{
+	if (semph->job)
+		return OS_FAILED;
+
+	semph->job = job;
+	return OS_SUCCESS;
+}
+
+enum OS_STATUS os_job_bind_event(struct os_job *job, struct os_event *event, uint8_t flags)
+{
+	if (event->job)
+		return OS_FAILED;
+
+	event->job = job;
+	event->job_flags = flags;
+	return OS_SUCCESS;
+}
+
+void os_job_start_timer(struct os_job *job, uint16_t delay_ticks, uint16_t period_ticks)
+{
+	// Critical as SysTick_Handler walks and edits the timer list
+	uint32_t primask = os_irq_save();
+	bool armed = job->timeout > 0;
+	job->period = period_ticks;
+	job->timeout = delay_ticks;
+
+	if (delay_ticks > 0 && !armed)
+		os_job_timer_insert(job);
+	else if (delay_ticks == 0 && armed)
+		os_job_timer_remove(job);
+	os_irq_restore(primask);
+}
+
+
+
+/***************************************************************************************************
+ * Statistics Functions
+ **************************************************************************************************/
+#if OS_STATS_ENABLED
+const struct os_mutex_stats *os_mutex_stats_query(const struct os_mutex *mutex)
+{
+	return &mutex->stats;
+}
+
+const struct os_wait_stats *os_semph_stats_query(const struct os_semph *semph)
+{
+	return &semph->stats;
+}
+
+const struct os_queue_stats *os_queue_stats_query(const struct os_queue *queue)
+{
+	return &queue->stats;
+}
+
+const struct os_wait_stats *os_event_stats_query(const struct os_event *event)
+{
+	return &event->stats;
+}
+#endif
+
+
+
 /***************************************************************************************************
  * Port-Specific (Cortex-M3) Interrupts
  **************************************************************************************************/
 void SysTick_Handler(void)
 {
+	OS_STATS(tick_count++;)
+
 	/* Naive approach, optimize later (don't want to have to loop over
 	* every task, only tasks in a timeout list) */
 	for (int i = 0; i < task_count; i++) {
 		struct os_tcb *task = &tasks[i];
 
-		if (task->timeout > 0) {
+		if (task->state == TASK_BLOCKED && task->timeout > 0) {
 			task->timeout--;
-			if (task->timeout == 0)
+			if (task->timeout == 0) {
+				/* A task that timed out waiting on a kernel object must leave that
+				   object's blocked list before it joins a ready list, as both share
+				   the same links. Otherwise a later wake would find it there. */
+				if (task->blocked_list) {
+					os_list_remove_task(task, task->blocked_list);
+					task->blocked_list = NULL;
+				}
+
 				os_task_set_state(task, TASK_READY);
+			}
+		}
+	}
+
+	struct os_job *job = timer_jobs;
+	while (job) {
+		struct os_job *next = job->next_timer;
+
+		if (--job->timeout == 0) {
+			// One-shot timers disarm, periodic timers reload
+			job->timeout = job->period;
+			if (job->timeout == 0)
+				os_job_timer_remove(job);
+
+			os_job_trigger(job);
 		}
+
+		job = next;
 	}
 
 	SW_CONTEXT();
 }
 
-void PendSV_Handler(void)
+/* Picks the task PendSV_Handler should switch to and makes it the running task. It has external
+   linkage because it is only called by name from PendSV_Handler's assembly: a static function
+   could be renamed by the compiler (e.g. with -flto) and the branch would no longer link. The
+   used attribute stops it being discarded as unreferenced.
+
+   Both TCBs are handed back packed into a uint64_t because AAPCS returns 64-bit values in r0 (low
+   word) and r1 (high word), letting the handler get the outgoing TCB in r0 and the incoming TCB
+   in r1 without touching memory. The incoming TCB is NULL if no switch is needed (including when
+   the scheduler picks the task that is already running), and the outgoing TCB is NULL when
+   starting the very first task. */
+__attribute__((used, noinline)) uint64_t os_task_switch_select(void)
 {
 	uint8_t highest_ready_pri = os_get_highest_ready_pri();
 	struct os_tcb *next_task = os_get_next_ready_task(highest_ready_pri);
 
-	// Make sure there is a higher priority task that's ready before context switch
-	if (next_task) {
-		prev_task = running_task;
-		running_task = next_task;
-		
-		// Store old context
-		if (prev_task) {
-			asm volatile(
-				"mrs r0, psp\n"
-				"mov r2, %0\n"
-				"stmdb r0!, {r4-r11}\n"
-				"str r0, [r2]\n"
-				: : "r"(&prev_task->stack_pntr)
-			);
-		}
+	if (!next_task || next_task == running_task)
+		return 0;
+
+	struct os_tcb *prev_task = running_task;
+	running_task = next_task;
+
+	return ((uint64_t)(uint32_t)next_task << 32) | (uint32_t)prev_task;
+}
+
+/* Naked so the compiler emits no prologue/epilogue and can't touch r4-r11 or the stack behind our
+   back, meaning this is correct at every optimization level. r4-r11 are callee-saved, so the
+   scheduler is run first and the registers are only saved and restored when actually switching
+   tasks. Returning straight through EXC_RETURN also lets the core tail-chain into any pending
+   interrupt. */
+__attribute__((naked)) void PendSV_Handler(void)
+{
+	asm volatile(
+		"push {r3, lr}\n"		// Save EXC_RETURN (r3 keeps MSP 8-byte aligned)
+		"bl os_task_switch_select\n"	// r0 = outgoing TCB, r1 = incoming TCB
+		"pop {r3, lr}\n"
+		"cbz r1, 2f\n"			// Nothing to switch to
+		"cbz r0, 1f\n"			// First task, no context to save
+
+		// Store old context (stack_pntr is the first member of os_tcb)
+		"mrs r2, psp\n"
+		"stmdb r2!, {r4-r11}\n"
+		"str r2, [r0]\n"
 
 		// Load new context
-		asm volatile(
-			"mov r2, %0\n"
-			"ldr r0, [r2]\n"
-			"ldmia r0!, {r4-r11}\n"
-			"msr psp, r0\n"
-			: : "r"(&running_task->stack_pntr)
-		);
-	}
+		"1:\n"
+		"ldr r2, [r1]\n"
+		"ldmia r2!, {r4-r11}\n"
+		"msr psp, r2\n"
+
+		"2:\n"
+		"bx lr\n"
+	);
 }
@@ -7,11 +7,48 @@
 
 /***************************************************************************************************
  * Config (Modified By User)
+ *
+ * Each option may also be overridden without editing this file, either by passing it on the
+ * compiler command line (e.g. -DMAX_NUM_TASKS=4) or by defining OS_CONFIG_FILE as the name of a
+ * header that defines it (e.g. -DOS_CONFIG_FILE='"os_config.h"').
  **************************************************************************************************/
+#ifdef OS_CONFIG_FILE
+#include OS_CONFIG_FILE
+#endif
+
+// Includes the idle task and any job host tasks
+#ifndef MAX_NUM_TASKS
 #define MAX_NUM_TASKS 32
+#endif
+
+#ifndef MAX_PRIORITY_LEVEL
 #define MAX_PRIORITY_LEVEL 31
+#endif
+
+#ifndef IDLE_TASK_STACK_SZ
+#define IDLE_TASK_STACK_SZ 32
+#endif
+
+#ifndef OS_CLK_HZ
 #define OS_CLK_HZ 100
+#endif
+
+#ifndef CPU_CLK_HZ
 #define CPU_CLK_HZ 72000000UL
+#endif
+
+// Priority levels available to the jobs of a job host (0 to OS_JOB_PRIORITY_LEVELS - 1), max 32
+#ifndef OS_JOB_PRIORITY_LEVELS
+#define OS_JOB_PRIORITY_LEVELS 8
+#endif
+
+// Set to 1 to collect contention/utilisation statistics on mutexes, semaphores, queues and events
+#ifndef OS_STATS_ENABLED
+#define OS_STATS_ENABLED 0
+#endif
+
+// If defined, the build fails when the kernel's static RAM (OS_KERNEL_RAM_SZ) exceeds this
+// #define OS_KERNEL_RAM_BUDGET 1024
 /***************************************************************************************************
  * End Config (Do NOT modify below this)
  **************************************************************************************************/
@@ -21,7 +58,10 @@
 /***************************************************************************************************
  * Public Typedefs
  **************************************************************************************************/
+struct os_job;
+
 typedef void (*os_task_entry)(void *);
+typedef void (*os_job_entry)(struct os_job *, void *);
 typedef uint32_t os_task_stack;
 
 
@@ -34,6 +74,36 @@ typedef uint32_t os_task_stack;
 #define OS_MSEC_TO_TICKS(msec) (((msec) * OS_CLK_HZ) / 1000)
 #define OS_SEC_TO_TICKS(sec) (OS_MSEC_TO_TICKS((sec) * 1000))
 #define OS_QUEUE_SZ(length, item_sz) ((length) * (item_sz))
+#define OS_INVALID_TASK_ID UINT8_MAX
+#define OS_PQUEUE_SZ(length, item_sz) ((length) * ((item_sz) + 1))
+
+/* Protothread-style helpers for writing a job as a coroutine. A job's local variables are NOT
+   preserved across OS_JOB_YIELD/OS_JOB_WAIT_UNTIL (the job runs on a shared stack), so keep any
+   state in static variables or in the job's arg. A switch statement can't be used between
+   OS_JOB_BEGIN and OS_JOB_END.
+
+   OS_JOB_YIELD - returns to the host, resuming after the yield on the job's next activation
+   OS_JOB_WAIT_UNTIL - returns to the host until cond is true when checked on an activation */
+#define OS_JOB_BEGIN(job) switch ((job)->lc) { case 0:
+#define OS_JOB_YIELD(job) do { (job)->lc = __LINE__; return; case __LINE__:; } while (0)
+#define OS_JOB_WAIT_UNTIL(job, cond) do { \
+	(job)->lc = __LINE__; __attribute__((fallthrough)); case __LINE__: \
+	if (!(cond)) \
+		return; \
+} while (0)
+#define OS_JOB_END(job) } (job)->lc = 0
+
+/* Total static RAM used by the kernel itself in bytes (task table, ready lists, idle task stack
+   and scheduler state). Does not include user-provided task stacks or kernel objects. The value
+   is also emitted as the absolute symbol os_kernel_ram_sz, so it appears in the map file and in
+   nm output. */
+#define OS_KERNEL_RAM_SZ ((sizeof(struct os_tcb) * MAX_NUM_TASKS) \
+			+ (sizeof(struct os_tcb *) * (MAX_PRIORITY_LEVEL + 1)) \
+			+ (sizeof(os_task_stack) * IDLE_TASK_STACK_SZ) \
+			+ sizeof(struct os_tcb *) + sizeof(uint32_t) \
+			+ sizeof(uint8_t) * 2 \
+			+ sizeof(struct os_job *) \
+			+ (OS_STATS_ENABLED ? sizeof(uint32_t) : 0))
 
 
 
@@ -51,35 +121,77 @@ enum OS_STATUS {
 	OS_TIMEOUT
 };
 
+enum OS_QUEUE_SET_TYPE {
+	QUEUE_SET_QUEUE,
+	QUEUE_SET_SEMPH
+};
+
 
 
 /***************************************************************************************************
  * Public Structures
  **************************************************************************************************/
-// TODO: Consider rearranging members for efficient struct packing
+/* Members are ordered largest to smallest so there is no padding between them (only a byte of
+   tail padding), with the fields touched on every context switch and scheduler pass kept
+   together at the front. stack_pntr must remain the first member. The entry function and its
+   argument are only needed while building the initial stack frame, so they are not stored. */
 struct os_tcb {
-	os_task_entry entry;
-	void *arg;
 	os_task_stack *stack_pntr;
-	uint8_t priority;
-	enum OS_TASK_STATE state;
 	struct os_tcb *next_task;
 	struct os_tcb *prev_task;
+	struct os_tcb **blocked_list; // The kernel object list the task is waiting on, if any
 	uint16_t timeout;
+	uint8_t priority;
+	uint8_t state; // enum OS_TASK_STATE
 	bool waiting;
 	uint8_t wait_flags;
 	uint8_t id;
 };
 
+struct os_queue_set;
+struct os_job_host;
+
+#if OS_STATS_ENABLED
+// All times are in OS clock ticks
+struct os_mutex_stats {
+	uint32_t acquire_count;
+	uint32_t contended_count;
+	uint32_t total_wait_ticks;
+	uint32_t max_wait_ticks;
+	uint32_t max_hold_ticks;
+};
+
+struct os_queue_stats {
+	size_t high_water;
+	uint32_t full_count;
+	uint32_t empty_count;
+};
+
+// Used by both semaphores and event groups
+struct os_wait_stats {
+	uint32_t wait_count;
+	uint32_t timeout_count;
+};
+#endif
+
 struct os_mutex {
 	struct os_tcb *holding_task;
 	uint8_t holding_task_orig_pri;
 	struct os_tcb *blocked_list;
+#if OS_STATS_ENABLED
+	uint32_t acquire_tick; // Tick the mutex was last acquired on (used to find hold time)
+	struct os_mutex_stats stats;
+#endif
 };
 
 struct os_semph {
 	uint8_t count;
 	struct os_tcb *blocked_list;
+	struct os_queue_set *set;
+	struct os_job *job;
+#if OS_STATS_ENABLED
+	struct os_wait_stats stats;
+#endif
 };
 
 struct os_queue {
@@ -91,10 +203,68 @@ struct os_queue {
 	bool full;
 	struct os_tcb *rec_blocked_list;
 	struct os_tcb *ins_blocked_list;
+	struct os_queue_set *set;
+	struct os_job *job;
+#if OS_STATS_ENABLED
+	struct os_queue_stats stats;
+#endif
+};
+
+struct os_pqueue {
+	size_t length;
+	size_t count;
+	size_t item_sz;
+	uint8_t *storage;
+	struct os_tcb *rec_blocked_list;
+	struct os_tcb *ins_blocked_list;
 };
 
 struct os_event {
 	uint8_t flags;
+	uint8_t job_flags; // Flags that must all be set to trigger job
+	struct os_tcb *blocked_list;
+	struct os_job *job;
+#if OS_STATS_ENABLED
+	struct os_wait_stats stats;
+#endif
+};
+
+struct os_cond {
+	struct os_tcb *blocked_list;
+};
+
+struct os_queue_set_member {
+	enum OS_QUEUE_SET_TYPE type;
+	void *obj;
+};
+
+struct os_queue_set {
+	struct os_queue_set_member *members;
+	size_t length;
+	size_t count;
+	struct os_tcb *blocked_list;
+};
+
+// A lightweight run-to-completion task, dispatched by a host task on the host's stack
+struct os_job {
+	os_job_entry entry;
+	void *arg;
+	struct os_job_host *host;
+	struct os_job *next_pending;
+	struct os_job *next_timer;
+	struct os_job *prev_timer;
+	uint16_t timeout;
+	uint16_t period;
+	uint16_t lc; // Resume point for OS_JOB_YIELD/OS_JOB_WAIT_UNTIL
+	uint8_t priority;
+	uint8_t pending; // Number of activations yet to run
+};
+
+// Pending jobs are kept in a FIFO list per priority, with a bit set for each non-empty list
+struct os_job_host {
+	struct os_job *pending_head[OS_JOB_PRIORITY_LEVELS];
+	struct os_job *pending_tail[OS_JOB_PRIORITY_LEVELS];
+	uint32_t pending_pris;
 	struct os_tcb *blocked_list;
 };
 
@@ -114,7 +284,8 @@ Starts the OS. Should be called after all tasks have been created.
 void os_start(void);
 
 /*
-Creates a new task. Returns the ID of the new task.
+Creates a new task. Returns the ID of the new task, or OS_INVALID_TASK_ID if MAX_NUM_TASKS tasks
+(including the idle task and any job hosts) already exist.
 
 entry - function pointer to task's entry function
 arg - pointer to data to be passed to task's entry function
@@ -231,6 +402,66 @@ Returns OS_SUCCESS if successful, OS_FAILED otherwise (does not wait).
 */
 enum OS_STATUS os_queue_retrieve_isr(struct os_queue *queue, void *item);
 
+/*
+Same as os_queue_insert, except the item is placed at the front of the queue so it is the next one
+to be retrieved.
+
+Returns OS_SUCCESS if successful, OS_TIMEOUT otherwise.
+*/
+enum OS_STATUS os_queue_insert_front(struct os_queue *queue, const void *item,
+					uint16_t timeout_ticks);
+
+/*
+An ISR-safe version of os_queue_insert_front.
+
+Returns OS_SUCCESS if successful, OS_FAILED otherwise (does not wait).
+*/
+enum OS_STATUS os_queue_insert_front_isr(struct os_queue *queue, const void *item);
+
+/*
+Creates and initializes the given priority queue. Items are retrieved highest priority first, and
+in FIFO order among items of the same priority.
+The SIZE of the storage buffer must be OS_PQUEUE_SZ(length, item_sz), as each item is stored
+alongside its priority.
+
+pqueue - the priority queue to be created
+length - the max number of elements the queue can hold
+storage - the storage buffer for the queue
+item_sz - the size of an individual item in the queue in bytes
+*/
+void os_pqueue_create(struct os_pqueue *pqueue, size_t length, uint8_t *storage, size_t item_sz);
+
+/*
+Copies the given item into the priority queue with the given priority, sleeping the specified
+number of ticks if the queue is currently full.
+
+Returns OS_SUCCESS if successful, OS_TIMEOUT otherwise.
+*/
+enum OS_STATUS os_pqueue_insert(struct os_pqueue *pqueue, const void *item, uint8_t priority,
+				uint16_t timeout_ticks);
+
+/*
+Removes and copies the highest priority element from the given priority queue into the given item,
+sleeping the specified number of ticks if the queue is currently empty.
+
+Returns OS_SUCCESS if successful, OS_TIMEOUT otherwise.
+*/
+enum OS_STATUS os_pqueue_retrieve(struct os_pqueue *pqueue, void *item, uint16_t timeout_ticks);
+
+/*
+An ISR-safe version of os_pqueue_insert.
+
+Returns OS_SUCCESS if successful, OS_FAILED otherwise (does not wait).
+*/
+enum OS_STATUS os_pqueue_insert_isr(struct os_pqueue *pqueue, const void *item, uint8_t priority);
+
+/*
+An ISR-safe version of os_pqueue_retrieve.
+
+Returns OS_SUCCESS if successful, OS_FAILED otherwise (does not wait).
+*/
+enum OS_STATUS os_pqueue_retrieve_isr(struct os_pqueue *pqueue, void *item);
+
 /*
 Create and intialize the given event group.
 */
@@ -254,4 +485,161 @@ An ISR-safe version of os_event_set.
 */
 void os_event_set_isr(struct os_event *event, uint8_t flags);
 
+/*
+Creates and initializes the given condition variable.
+*/
+void os_cond_create(struct os_cond *cond);
+
+/*
+Atomically releases the given mutex (which the running task must hold) and sleeps the specified
+number of ticks or until the condition variable is signaled. The mutex is always reacquired before
+returning, even on timeout, so the caller should re-check its condition in a loop.
+
+Returns OS_SUCCESS if signaled, OS_TIMEOUT otherwise.
+*/
+enum OS_STATUS os_cond_wait(struct os_cond *cond, struct os_mutex *mutex, uint16_t timeout_ticks);
+
+/*
+Wakes the highest priority task waiting on the given condition variable, if any.
+*/
+void os_cond_signal(struct os_cond *cond);
+
+/*
+Wakes ALL tasks waiting on the given condition variable.
+*/
+void os_cond_broadcast(struct os_cond *cond);
+
+/*
+Creates and initializes the given queue set.
+
+set - the queue set to be created
+members - the storage buffer for the set's members
+length - the max number of queues and semaphores the set can hold
+*/
+void os_queue_set_create(struct os_queue_set *set, struct os_queue_set_member *members,
+				size_t length);
+
+/*
+Adds the given queue to the given queue set. A queue can only belong to one set.
+
+Returns OS_SUCCESS if successful, OS_FAILED if the set is full or the queue is already in a set.
+*/
+enum OS_STATUS os_queue_set_add_queue(struct os_queue_set *set, struct os_queue *queue);
+
+/*
+Adds the given semaphore to the given queue set. A semaphore can only belong to one set.
+
+Returns OS_SUCCESS if successful, OS_FAILED if the set is full or the semaphore is already in a set.
+*/
+enum OS_STATUS os_queue_set_add_semph(struct os_queue_set *set, struct os_semph *semph);
+
+/*
+The running task will sleep the specified number of ticks or until any queue in the given set has
+an item or any semaphore in the set has a non-zero count. On success, the ready member is copied
+into the given member so the caller knows which object to retrieve from or take (with a timeout
+of 0). Members of a set should only be read by the task selecting on it. If the member that woke
+the task has already been emptied by another reader, the task waits again for whatever is left of
+the timeout, so the total time spent waiting never exceeds timeout_ticks.
+
+Returns OS_SUCCESS if successful, OS_TIMEOUT otherwise.
+*/
+enum OS_STATUS os_queue_set_select(struct os_queue_set *set, struct os_queue_set_member *member,
+					uint16_t timeout_ticks);
+
+#if OS_STATS_ENABLED
+/*
+Returns the statistics of the given mutex: how often it was acquired, how often an acquire had to
+wait because it was already held, the total and max time spent waiting, and the max time it was
+held.
+*/
+const struct os_mutex_stats *os_mutex_stats_query(const struct os_mutex *mutex);
+
+/*
+Returns the statistics of the given semaphore: how often a take found the count at 0 and how
+many of those timed out.
+*/
+const struct os_wait_stats *os_semph_stats_query(const struct os_semph *semph);
+
+/*
+Returns the statistics of the given queue: the most items it has ever held at once, and how often
+an insert found it full or a retrieve found it empty.
+*/
+const struct os_queue_stats *os_queue_stats_query(const struct os_queue *queue);
+
+/*
+Returns the statistics of the given event group: how often a wait found the flags not yet set
+and how many of those timed out.
+*/
+const struct os_wait_stats *os_event_stats_query(const struct os_event *event);
+#endif
+
+/*
+Creates a host task that runs jobs. Every job registered to the host runs on the host's stack, so
+it must be sized for the deepest job. Returns the ID of the host task, or OS_INVALID_TASK_ID if no
+task slots are left.
+
+host - the job host to be created
+stack_base - pointer to the base (lowest address) of the host's stack
+stack_sz - the size of the stack in number of 32-bit words
+priority - the priority of the host task (jobs only run when the host is scheduled)
+*/
+uint8_t os_job_host_create(struct os_job_host *host, os_task_stack *stack_base, size_t stack_sz,
+				uint8_t priority);
+
+/*
+Creates a job and registers it with the given host. The job's entry function is called once per
+activation, highest job priority first, with jobs of the same priority taking turns. A job must
+run to completion: it must never block, so any kernel calls it makes should use a timeout of 0.
+
+job - the job to be created
+host - the host that dispatches the job
+entry - function pointer to job's entry function
+arg - pointer to data to be passed to job's entry function
+priority - the priority of the job relative to the host's other jobs, from 0 to
+	OS_JOB_PRIORITY_LEVELS - 1
+*/
+void os_job_create(struct os_job *job, struct os_job_host *host, os_job_entry entry, void *arg,
+			uint8_t priority);
+
+/*
+Activates the given job, causing it to run once when its host gets to it.
+*/
+void os_job_activate(struct os_job *job);
+
+/*
+An ISR-safe version of os_job_activate.
+*/
+void os_job_activate_isr(struct os_job *job);
+
+/*
+Activates the given job every time an item is inserted into the given queue. A queue can only
+trigger one job.
+
+Returns OS_SUCCESS if successful, OS_FAILED if the queue already triggers a job.
+*/
+enum OS_STATUS os_job_bind_queue(struct os_job *job, struct os_queue *queue);
+
+/*
+Activates the given job every time the given semaphore is given. A semaphore can only trigger one
+job.
+
+Returns OS_SUCCESS if successful, OS_FAILED if the semaphore already triggers a job.
+*/
+enum OS_STATUS os_job_bind_semph(struct os_job *job, struct os_semph *semph);
+
+/*
+Activates the given job every time the given flags of the given event group are all set. The job
+is responsible for clearing them (e.g. with os_event_wait and a timeout of 0). An event group can
+only trigger one job, but a job can be bound to several event groups, each with its own flags.
+
+Returns OS_SUCCESS if successful, OS_FAILED if the event group already triggers a job.
+*/
+enum OS_STATUS os_job_bind_event(struct os_job *job, struct os_event *event, uint8_t flags);
+
+/*
+Activates the given job after the specified number of ticks, then every period_ticks after that.
+A period of 0 activates the job only once, and a delay of 0 stops the timer.
+*/
+void os_job_start_timer(struct os_job *job, uint16_t delay_ticks, uint16_t period_ticks);
+
 #endif